@@ -0,0 +1,61 @@
+/*
+    Host stand-in for the parts of the Arduino core used by
+    encrypted_communication_part2.cpp, so protocol_bench.cpp can run the
+    sketch unchanged on a PC. Every call is routed to the simulated board
+    running on the calling thread; see protocol_bench.cpp for the timing model.
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define A1 1
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(string_literal))
+
+void init();
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+unsigned long millis();
+void delay(unsigned long ms);
+
+// Serial: the operator's keyboard and display
+class ConsolePort {
+public:
+    void begin(long baud);
+    int available();
+    int read();
+    void print(const __FlashStringHelper* s);
+    void print(char c);
+    void print(int num);
+    void print(unsigned int num);
+    void print(long num);
+    void print(unsigned long num);
+    void println(const __FlashStringHelper* s);
+    void println(int num);
+    void println(unsigned int num);
+    void println(long num);
+    void println(unsigned long num);
+    void println();
+    void flush();
+};
+
+// Serial3: the link to the other board
+class LinkPort {
+public:
+    void begin(long baud);
+    int available();
+    int read();
+    void write(uint8_t b);
+};
+
+extern ConsolePort Serial;
+extern LinkPort Serial3;
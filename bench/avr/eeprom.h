@@ -0,0 +1,11 @@
+/*
+    Host stand-in for avr-libc's EEPROM block functions; each simulated
+    board has its own EEPROM image in protocol_bench.cpp.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+void eeprom_read_block(void* dst, const void* src, size_t n);
+void eeprom_update_block(const void* src, void* dst, size_t n);
@@ -0,0 +1,944 @@
+/*
+    Encrypted Arduino Communication - End-to-End Protocol Benchmark
+    CMPUT 274 Fall 2019
+
+    Runs two copies of encrypted_communication_part2.cpp (a client and a
+    server board) on the host, from reset through key generation,
+    handshake() and communication(). The boards talk over a simulated
+    serial link, and the client's Serial input is fed from a scripted
+    typing or bulk-paste workload. The benchmark reports what an operator
+    would see: key generation time, handshake time on each board (from
+    having its keys to "Ready after", so key generation is not included),
+    keystroke-to-display latency on the server, characters per second, and
+    the CPU time per character the client spends sending (encrypt) and the
+    server spends receiving (decrypt).
+
+    Timing model (all times are virtual; the benchmark runs faster than real time):
+      - each board has its own clock; the board with the earlier clock runs,
+        so neither board can see bytes from the other board's future
+      - delay() advances the clock; code between Arduino calls advances it by
+        the host CPU time it took, multiplied by --cpu-scale. At the default
+        scale of 1 the crypto costs host time, which is too small to show up
+        in the latency columns. A 16 MHz Mega2560 does every 32-bit % in a
+        software routine, and a scale of about 5000 brings decrypt() to the
+        tens of milliseconds it takes there
+      - during data exchange, the CPU time charged when a board writes to
+        Serial3 counts as sending, and the time charged when it prints a
+        character counts as receiving
+      - a byte on Serial3 takes 10 bits / baud to send, then arrives after
+        --latency-ms plus up to --jitter-ms, or is lost with probability --drop
+      - like HardwareSerial, each board has 64-byte receive and transmit
+        buffers: write() blocks while the transmit buffer is full, and bytes
+        that arrive while the receive buffer is full are lost
+      - Serial has the same 64-byte receive buffer, so keystrokes typed
+        while the sketch is busy (a paste faster than the link can carry)
+        are lost once it is full; they are counted in "keys lost"
+
+    Modes:
+      crypto: the partner exponent class (fixed e = 17, fixed e = 65537, or a
+              random 15-bit e), set by seeding each board's EEPROM key cache;
+              "cold" starts from blank EEPROM and runs the sketch's own keygen
+      transport: "full" does the 'C'/'A' key exchange, "resume" starts with
+              both boards holding each other's key so the 'R'/'K' resume is used
+
+    Build (host only, not part of the Arduino Makefile):
+        g++ -std=c++11 -O2 -pthread -I. -o protocol_bench protocol_bench.cpp
+
+    Usage:
+        ./protocol_bench [--workload typing|paste] [--chars N] [--cps R]
+                         [--baud B] [--latency-ms L] [--jitter-ms J] [--drop P]
+                         [--cpu-scale S] [--seed X] [--verbose]
+        ./protocol_bench --keygen N [--seed X]
+
+    --keygen runs public key selection plus the private key inverse for N
+    keypairs, with the division-based Euclid routines the sketch used to
+    have (kept below as a reference) against the sketch's binary ones
+    (gcd_binary, inverse_binary). For each it reports host time and the
+    32-bit operations done per keypair, with an AVR cycle estimate from
+    those counts, since division costs far more on the board than on the
+    host. It also checks inverse_binary<uint64_t> on 62-bit moduli.
+*/
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// two independent copies of the sketch, one per board
+namespace board0 {
+#include "../encrypted_communication_part2.cpp"
+uint8_t __heap_start;
+uint8_t* __brkval;
+}
+
+namespace board1 {
+#include "../encrypted_communication_part2.cpp"
+uint8_t __heap_start;
+uint8_t* __brkval;
+}
+
+/*
+    Benchmark settings
+*/
+struct Config {
+    std::string workload = "typing";
+    unsigned int chars = 200;
+    double cps = 8;
+    long baud = 9600;
+    double latencyMs = 0;
+    double jitterMs = 0;
+    double drop = 0;
+    double cpuScale = 1;
+    unsigned int seed = 1;
+    bool verbose = false;
+};
+
+Config config;
+
+// HardwareSerial buffer size on the Mega2560
+const size_t serialBuffer = 64;
+
+// virtual cost of one pass through a polling loop (us)
+const int64_t pollCost = 5;
+
+// give up this long (us) after the last keystroke
+const int64_t drainTimeout = 10000000;
+
+// give up if a run has not finished by this virtual time (us)
+const int64_t runLimit = 600000000;
+
+struct InFlight {
+    int64_t arrival;
+    uint8_t value;
+};
+
+struct Keystroke {
+    int64_t time;
+    char c;
+};
+
+// a character the server should display, with the keystroke that caused it
+struct Expected {
+    int64_t time;
+    char c;
+};
+
+struct Endpoint {
+    int id;
+    bool server;
+    int64_t now;
+    double cpuMark;
+    bool finished;
+    // CPU time (us, after --cpu-scale) charged during data exchange
+    double sendCpuUs, recvCpuUs;
+
+    std::vector<uint8_t> eeprom;
+
+    // Serial3
+    std::deque<InFlight> inFlight;
+    std::deque<uint8_t> rx;
+    int64_t lineFree;
+    int64_t lastArrival;
+    uint64_t overflowDrops;
+
+    // Serial: offsets of the scripted keystrokes, scheduled once the board is ready
+    std::vector<Keystroke> script;
+    // keystrokes not typed yet, and typed ones in the receive buffer
+    std::deque<Keystroke> console;
+    std::deque<Keystroke> consoleRx;
+    uint64_t keysLost;
+    int64_t readyAt;
+    int64_t keygenAt;
+
+    // characters printed by communication()
+    std::vector<std::pair<int64_t, char>> displayed;
+};
+
+struct StopEndpoint {};
+
+std::mutex batonLock;
+std::condition_variable batonPassed;
+int turn;
+bool stopping;
+Endpoint endpoints[2];
+std::vector<Expected> expected;
+std::mt19937 linkRng;
+
+thread_local Endpoint* self;
+
+double threadCpuUs() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+Endpoint& peer() {
+    return endpoints[1 - self->id];
+}
+
+// true once the server showed everything the client sent, or the run timed out
+bool runFinished() {
+    Endpoint& client = endpoints[0];
+    Endpoint& server = endpoints[1];
+    int64_t earliest = std::min(client.finished ? runLimit : client.now,
+                                server.finished ? runLimit : server.now);
+    if (earliest >= runLimit) {
+        return true;
+    }
+    if (client.readyAt < 0 || !client.console.empty() || !client.consoleRx.empty()) {
+        return false;
+    }
+    if (server.displayed.size() >= expected.size()) {
+        return true;
+    }
+    int64_t lastKey = client.script.empty() ? client.readyAt
+                      : client.readyAt + client.script.back().time;
+    return earliest > lastKey + drainTimeout;
+}
+
+/*
+    Charges the CPU time used since the last Arduino call to this board's
+    clock, then hands over to the other board if it is now behind.
+    Returns the time charged (us).
+*/
+double sync() {
+    Endpoint& me = *self;
+    double charged = (threadCpuUs() - me.cpuMark) * config.cpuScale;
+    me.now += (int64_t) charged;
+    std::unique_lock<std::mutex> lock(batonLock);
+    if (!stopping && runFinished()) {
+        stopping = true;
+        batonPassed.notify_all();
+    }
+    Endpoint& other = peer();
+    if (!stopping && !other.finished && me.now > other.now) {
+        turn = other.id;
+        batonPassed.notify_all();
+        batonPassed.wait(lock, [&] { return turn == me.id || stopping; });
+    }
+    if (stopping) {
+        throw StopEndpoint();
+    }
+    me.cpuMark = threadCpuUs();
+    return charged;
+}
+
+// moves bytes that have arrived by now into the receive buffer
+void deliver(Endpoint& me) {
+    while (!me.inFlight.empty() && me.inFlight.front().arrival <= me.now) {
+        if (me.rx.size() < serialBuffer) {
+            me.rx.push_back(me.inFlight.front().value);
+        } else {
+            me.overflowDrops++;
+        }
+        me.inFlight.pop_front();
+    }
+}
+
+// moves keystrokes typed by now into Serial's receive buffer
+void deliverConsole(Endpoint& me) {
+    while (!me.console.empty() && me.console.front().time <= me.now) {
+        if (me.consoleRx.size() < serialBuffer) {
+            me.consoleRx.push_back(me.console.front());
+        } else {
+            me.keysLost++;
+        }
+        me.console.pop_front();
+    }
+}
+
+int64_t byteTime() {
+    // start bit, 8 data bits, stop bit
+    return 10 * 1000000LL / config.baud;
+}
+
+/*
+    Arduino core
+*/
+
+void init() {}
+void pinMode(uint8_t, uint8_t) {}
+
+int digitalRead(uint8_t) {
+    return self->server ? HIGH : LOW;
+}
+
+int analogRead(uint8_t) {
+    sync();
+    return (int) (linkRng() & 1023);
+}
+
+unsigned long millis() {
+    sync();
+    return (unsigned long) (self->now / 1000);
+}
+
+void delay(unsigned long ms) {
+    self->now += (int64_t) ms * 1000;
+    sync();
+}
+
+void eeprom_read_block(void* dst, const void* src, size_t n) {
+    memcpy(dst, &self->eeprom[(size_t) src], n);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n) {
+    memcpy(&self->eeprom[(size_t) dst], src, n);
+}
+
+void LinkPort::begin(long) {}
+
+int LinkPort::available() {
+    self->now += pollCost;
+    sync();
+    deliver(*self);
+    return (int) self->rx.size();
+}
+
+int LinkPort::read() {
+    deliver(*self);
+    if (self->rx.empty()) {
+        return -1;
+    }
+    uint8_t b = self->rx.front();
+    self->rx.pop_front();
+    return b;
+}
+
+void LinkPort::write(uint8_t b) {
+    Endpoint& me = *self;
+    double charged = sync();
+    if (me.readyAt >= 0) {
+        // encrypt() and uint32_to_serial3() since the last call
+        me.sendCpuUs += charged;
+    }
+    int64_t bt = byteTime();
+    int64_t start = std::max(me.now, me.lineFree);
+    // block while the transmit buffer is full
+    int64_t backlog = start - me.now;
+    if (backlog > (int64_t) serialBuffer * bt) {
+        me.now = start - (int64_t) serialBuffer * bt;
+        sync();
+    }
+    me.lineFree = start + bt;
+    std::uniform_real_distribution<double> unit(0, 1);
+    if (unit(linkRng) < config.drop) {
+        return;
+    }
+    int64_t arrival = me.lineFree + (int64_t) (config.latencyMs * 1000)
+                      + (int64_t) (unit(linkRng) * config.jitterMs * 1000);
+    Endpoint& other = peer();
+    // serial bytes cannot overtake each other
+    arrival = std::max(arrival, other.lastArrival);
+    other.lastArrival = arrival;
+    other.inFlight.push_back(InFlight{arrival, b});
+}
+
+void ConsolePort::begin(long) {}
+
+int ConsolePort::available() {
+    Endpoint& me = *self;
+    sync();
+    deliverConsole(me);
+    bool ready = !me.consoleRx.empty();
+    if (!ready && me.rx.empty() && (me.inFlight.empty() || me.inFlight.front().arrival > me.now)) {
+        // idle: skip ahead to the next keystroke or byte, at most 1 ms at a time
+        int64_t next = me.now + 1000;
+        if (!me.console.empty()) {
+            next = std::min(next, me.console.front().time);
+        }
+        if (!me.inFlight.empty()) {
+            next = std::min(next, me.inFlight.front().arrival);
+        }
+        me.now = std::max(next, me.now + pollCost);
+        sync();
+        deliverConsole(me);
+        ready = !me.consoleRx.empty();
+    }
+    return ready ? 1 : 0;
+}
+
+int ConsolePort::read() {
+    Endpoint& me = *self;
+    deliverConsole(me);
+    if (me.consoleRx.empty()) {
+        return -1;
+    }
+    Keystroke k = me.consoleRx.front();
+    me.consoleRx.pop_front();
+    // communication() sends "\r\n" for enter
+    if (k.c == '\r') {
+        expected.push_back(Expected{k.time, '\r'});
+        expected.push_back(Expected{k.time, '\n'});
+    } else {
+        expected.push_back(Expected{k.time, k.c});
+    }
+    return (uint8_t) k.c;
+}
+
+void ConsolePort::print(const __FlashStringHelper* s) {
+    Endpoint& me = *self;
+    const char* text = (const char*) s;
+    if (strcmp(text, "Ready after ") == 0) {
+        // handshake finished: start the workload from here
+        me.readyAt = me.now;
+        for (const Keystroke& k : me.script) {
+            me.console.push_back(Keystroke{me.now + k.time, k.c});
+        }
+    }
+    if (config.verbose) {
+        printf("[%s %8.3f] %s", me.server ? "server" : "client", me.now / 1000.0, text);
+    }
+}
+
+void ConsolePort::println(const __FlashStringHelper* s) {
+    Endpoint& me = *self;
+    const char* text = (const char*) s;
+    if (strcmp(text, "generated keys") == 0 || strcmp(text, "Loaded keys from EEPROM") == 0) {
+        me.keygenAt = me.now;
+    }
+    if (config.verbose) {
+        printf("[%s %8.3f] %s\n", me.server ? "server" : "client", me.now / 1000.0, text);
+    }
+}
+
+void ConsolePort::print(char c) {
+    Endpoint& me = *self;
+    // only communication() prints single characters; charge the decrypt()
+    // before showing the character
+    double charged = sync();
+    me.recvCpuUs += charged;
+    me.displayed.push_back(std::make_pair(me.now, c));
+}
+
+void ConsolePort::print(int num) { if (config.verbose) printf("%d", num); }
+void ConsolePort::print(unsigned int num) { if (config.verbose) printf("%u", num); }
+void ConsolePort::print(long num) { if (config.verbose) printf("%ld", num); }
+void ConsolePort::print(unsigned long num) { if (config.verbose) printf("%lu", num); }
+void ConsolePort::println(int num) { if (config.verbose) printf("%d\n", num); }
+void ConsolePort::println(unsigned int num) { if (config.verbose) printf("%u\n", num); }
+void ConsolePort::println(long num) { if (config.verbose) printf("%ld\n", num); }
+void ConsolePort::println(unsigned long num) { if (config.verbose) printf("%lu\n", num); }
+void ConsolePort::println() { if (config.verbose) printf("\n"); }
+void ConsolePort::flush() {}
+
+ConsolePort Serial;
+LinkPort Serial3;
+
+
+/*
+    Keys for the crypto modes, generated on the host with the sketch's own
+    primality, binary GCD and binary inverse routines
+*/
+
+struct KeyPair {
+    uint32_t e, d, n;
+};
+
+uint32_t hostPrime(unsigned int k, std::mt19937& rng) {
+    uint32_t candidate = (rng() & ((1u << k) - 1)) + (1u << k);
+    while (!board0::primality(candidate)) {
+        candidate++;
+        if (candidate >= (1u << (k+1))) {
+            candidate = (1u << k);
+        }
+    }
+    return candidate;
+}
+
+// exponent 0 picks a random 15-bit exponent like publickey()
+KeyPair hostKeyPair(uint32_t exponent, std::mt19937& rng) {
+    KeyPair key;
+    uint32_t p, q, tot;
+    while (true) {
+        p = hostPrime(14, rng);
+        q = hostPrime(15, rng);
+        tot = (p-1)*(q-1);
+        key.e = exponent;
+        if (exponent == 0) {
+            key.e = (rng() & 0x7FFF) | 3;
+            while (board0::gcd_binary(key.e, tot) != 1) {
+                key.e += 2;
+            }
+        }
+        if (board0::gcd_binary(key.e, tot) == 1) {
+            break;
+        }
+    }
+    key.n = p*q;
+    key.d = board0::inverse_binary(key.e, tot);
+    return key;
+}
+
+// writes a key cache into a board's EEPROM image
+template <class Cache>
+void seedEeprom(Endpoint& ep, uint16_t magic, const KeyPair& own, const KeyPair* partner) {
+    Cache cache;
+    cache.magic = magic;
+    cache.ownPublicKey = own.e;
+    cache.ownPrivateKey = own.d;
+    cache.ownModulus = own.n;
+    cache.peerPublicKey = partner ? partner->e : 0;
+    cache.peerModulus = partner ? partner->n : 0;
+    memcpy(&ep.eeprom[0], &cache, sizeof(cache));
+}
+
+
+/*
+    Running one mode
+*/
+
+struct Mode {
+    const char* crypto;
+    const char* transport;
+    // 0 = random exponent; ignored for the cold boot
+    uint32_t exponent;
+    bool cold;
+    bool resume;
+};
+
+struct Result {
+    double keygenMs;
+    // per board, from keys ready (generated or loaded) to ready for data exchange
+    double clientHandshakeMs, serverHandshakeMs;
+    double p50, p99;
+    double charsPerSecond;
+    double sendUsPerChar, recvUsPerChar;
+    size_t delivered, errors;
+    uint64_t overflowDrops;
+    uint64_t keysLost;
+};
+
+std::vector<Keystroke> makeScript(std::mt19937& rng) {
+    const char text[] = "the quick brown fox jumps over the lazy dog\r";
+    size_t textLen = sizeof(text) - 1;
+    std::vector<Keystroke> script;
+    std::exponential_distribution<double> gap(config.cps);
+    double t = 0;
+    for (unsigned int i = 0; i < config.chars; i++) {
+        if (config.workload == "paste") {
+            // pasted text arrives as fast as the 9600 baud USB serial delivers it
+            t += 10.0 / 9600;
+        } else {
+            t += gap(rng);
+        }
+        script.push_back(Keystroke{(int64_t) (t * 1e6), text[i % textLen]});
+    }
+    return script;
+}
+
+template <void (*Main)(), uint8_t** Brk>
+void runBoard(Endpoint* ep) {
+    self = ep;
+    {
+        std::unique_lock<std::mutex> lock(batonLock);
+        batonPassed.wait(lock, [&] { return turn == ep->id || stopping; });
+    }
+    ep->cpuMark = threadCpuUs();
+    // the host has no SRAM layout to measure: put the heap end above the stack
+    // so paintStack() and stackHighWater() see an empty range
+    uint8_t here;
+    *Brk = &here;
+    try {
+        if (!stopping) {
+            Main();
+        }
+    } catch (StopEndpoint&) {
+    }
+    std::lock_guard<std::mutex> lock(batonLock);
+    ep->finished = true;
+    turn = 1 - ep->id;
+    batonPassed.notify_all();
+}
+
+void board0Main() { board0::main(); }
+void board1Main() { board1::main(); }
+
+Result runMode(const Mode& mode) {
+    std::mt19937 rng(config.seed);
+    linkRng.seed(config.seed);
+    for (int i = 0; i < 2; i++) {
+        Endpoint& ep = endpoints[i];
+        ep.id = i;
+        ep.server = (i == 1);
+        ep.now = 0;
+        ep.finished = false;
+        ep.sendCpuUs = ep.recvCpuUs = 0;
+        ep.eeprom.assign(4096, 0xFF);
+        ep.inFlight.clear();
+        ep.rx.clear();
+        ep.lineFree = 0;
+        ep.lastArrival = 0;
+        ep.overflowDrops = 0;
+        ep.script.clear();
+        ep.console.clear();
+        ep.consoleRx.clear();
+        ep.keysLost = 0;
+        ep.readyAt = -1;
+        ep.keygenAt = -1;
+        ep.displayed.clear();
+    }
+    expected.clear();
+    endpoints[0].script = makeScript(rng);
+
+    if (!mode.cold) {
+        KeyPair clientKey = hostKeyPair(mode.exponent, rng);
+        KeyPair serverKey = hostKeyPair(mode.exponent, rng);
+        seedEeprom<board0::KeyCache>(endpoints[0], board0::keyCacheMagic,
+                                     clientKey, mode.resume ? &serverKey : NULL);
+        seedEeprom<board1::KeyCache>(endpoints[1], board1::keyCacheMagic,
+                                     serverKey, mode.resume ? &clientKey : NULL);
+    }
+
+    turn = 0;
+    stopping = false;
+    std::thread client(runBoard<board0Main, &board0::__brkval>, &endpoints[0]);
+    std::thread server(runBoard<board1Main, &board1::__brkval>, &endpoints[1]);
+    client.join();
+    server.join();
+
+    Endpoint& c = endpoints[0];
+    Endpoint& s = endpoints[1];
+    Result r;
+    r.keygenMs = std::max(c.keygenAt, s.keygenAt) / 1000.0;
+    r.clientHandshakeMs = (c.readyAt - c.keygenAt) / 1000.0;
+    r.serverHandshakeMs = (s.readyAt - s.keygenAt) / 1000.0;
+    r.overflowDrops = c.overflowDrops + s.overflowDrops;
+    r.keysLost = c.keysLost;
+
+    std::vector<double> latency;
+    r.errors = 0;
+    size_t n = std::min(s.displayed.size(), expected.size());
+    for (size_t i = 0; i < n; i++) {
+        if (s.displayed[i].second != expected[i].c) {
+            r.errors++;
+        } else {
+            latency.push_back((s.displayed[i].first - expected[i].time) / 1000.0);
+        }
+    }
+    // characters that never showed up
+    r.errors += expected.size() - n;
+    r.delivered = latency.size();
+    std::sort(latency.begin(), latency.end());
+    r.p50 = latency.empty() ? 0 : latency[latency.size() / 2];
+    r.p99 = latency.empty() ? 0 : latency[(latency.size() - 1) * 99 / 100];
+    r.charsPerSecond = 0;
+    if (n > 0 && !expected.empty()) {
+        double span = (s.displayed[n - 1].first - expected[0].time) / 1e6;
+        r.charsPerSecond = span > 0 ? r.delivered / span : 0;
+    }
+
+    // the client sends every character and the server receives it
+    r.sendUsPerChar = r.delivered > 0 ? c.sendCpuUs / r.delivered : 0;
+    r.recvUsPerChar = r.delivered > 0 ? s.recvCpuUs / r.delivered : 0;
+    return r;
+}
+
+/*
+    Key generation routine comparison
+*/
+
+// 32-bit operations done by the key generation routines, per engine
+struct OpCounts {
+    uint64_t divs, muls, shiftBits, alu;
+};
+
+OpCounts ops;
+
+/*
+    Rough avr-gcc cycle costs on the Mega2560: / and % call the
+    __udivmodsi4 shift-and-subtract loop, * is built from the 8x8 hardware
+    multiplier, and add, subtract, compare, and/or and each bit of a shift
+    take about one cycle per byte.
+*/
+const double divCycles = 600;
+const double mulCycles = 40;
+const double shiftBitCycles = 4;
+const double aluCycles = 4;
+const double avrHz = 16e6;
+
+double avrCycles(const OpCounts& c) {
+    return c.divs * divCycles + c.muls * mulCycles + c.shiftBits * shiftBitCycles + c.alu * aluCycles;
+}
+
+/*
+    Reference routines: the division-based Euclid versions key generation
+    used before gcd_binary and inverse_binary (originally adapted from the
+    GCD program and Extended Euclidean Algorithm worksheet on eclass). Each
+    loop iteration adds the operations it does to ops.
+*/
+uint32_t gcd_euclid_fast(uint32_t a, uint32_t b) {
+    while (b > 0) {
+        ops.alu++;
+        ops.divs++;
+        a %= b;
+        uint32_t tmp = a;
+        a = b;
+        b = tmp;
+    }
+    ops.alu++;
+    return a;
+}
+
+int32_t ext_euclid(uint32_t e, uint32_t phi) {
+    uint32_t r0 = e, r1 = phi;
+    int32_t s0 = 1, s1 = 0;
+    while (r1 > 0) {
+        // compare, q, two products and two differences
+        ops.alu += 3;
+        ops.divs++;
+        ops.muls += 2;
+        uint32_t q = r0/r1;
+        uint32_t r2 = r0 - q*r1;
+        int32_t s2 = s0 - (int32_t) q*s1;
+        r0 = r1; r1 = r2;
+        s0 = s1; s1 = s2;
+    }
+    ops.alu++;
+    return s0;
+}
+
+int32_t reduce_mod(int32_t x, uint32_t m) {
+    ops.alu++;
+    if (x >= 0) {
+        ops.divs++;
+        return x % m;
+    }
+    ops.divs += 2;
+    ops.muls++;
+    ops.alu += 3;
+    uint32_t z = (-x/m) + 1;
+    return (x + z*m) % m;
+}
+
+/*
+    A uint32_t that adds every operation done on it to ops, so the sketch's
+    binary templates can be run as they are and counted
+*/
+struct Counted {
+    uint32_t v;
+    Counted(uint32_t x = 0) : v(x) {}
+};
+
+Counted operator+(Counted a, Counted b) { ops.alu++; return a.v + b.v; }
+Counted operator-(Counted a, Counted b) { ops.alu++; return a.v - b.v; }
+Counted operator*(Counted a, Counted b) { ops.muls++; return a.v * b.v; }
+Counted operator&(Counted a, Counted b) { ops.alu++; return a.v & b.v; }
+Counted operator|(Counted a, Counted b) { ops.alu++; return a.v | b.v; }
+Counted operator>>(Counted a, unsigned int n) { ops.shiftBits += n; return a.v >> n; }
+Counted operator<<(Counted a, unsigned int n) { ops.shiftBits += n; return a.v << n; }
+Counted& operator-=(Counted& a, Counted b) { a = a - b; return a; }
+Counted& operator*=(Counted& a, Counted b) { a = a * b; return a; }
+Counted& operator>>=(Counted& a, unsigned int n) { a = a >> n; return a; }
+bool operator==(Counted a, Counted b) { ops.alu++; return a.v == b.v; }
+bool operator!=(Counted a, Counted b) { ops.alu++; return a.v != b.v; }
+bool operator>(Counted a, Counted b) { ops.alu++; return a.v > b.v; }
+bool operator>=(Counted a, Counted b) { ops.alu++; return a.v >= b.v; }
+
+uint32_t plain(uint32_t x) { return x; }
+uint32_t plain(Counted x) { return x.v; }
+
+struct KeygenInput {
+    uint32_t tot;
+    uint32_t start;
+};
+
+// publickey() search from a given start, then the private key
+uint32_t euclidKeygen(const KeygenInput& in) {
+    uint32_t e = in.start;
+    while (gcd_euclid_fast(e, in.tot) != 1) {
+        e++;
+    }
+    return reduce_mod(ext_euclid(e, in.tot), in.tot);
+}
+
+template <typename T>
+uint32_t binaryKeygen(const KeygenInput& in) {
+    uint32_t e = in.start;
+    while (plain(board0::gcd_binary(T(e), T(in.tot))) != 1) {
+        e++;
+    }
+    return plain(board0::inverse_binary(T(e), T(in.tot)));
+}
+
+// host CPU time (us) per keypair
+template <uint32_t (*Keygen)(const KeygenInput&)>
+double timeKeygen(const std::vector<KeygenInput>& inputs, std::vector<uint32_t>& keys) {
+    const int reps = 20;
+    keys.assign(inputs.size(), 0);
+    double start = threadCpuUs();
+    for (int rep = 0; rep < reps; rep++) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            keys[i] = Keygen(inputs[i]);
+        }
+    }
+    return (threadCpuUs() - start) / (reps * inputs.size());
+}
+
+// operations per keypair, from one pass over the inputs
+template <uint32_t (*Keygen)(const KeygenInput&)>
+OpCounts countKeygen(const std::vector<KeygenInput>& inputs) {
+    ops = OpCounts{0, 0, 0, 0};
+    for (const KeygenInput& in : inputs) {
+        Keygen(in);
+    }
+    OpCounts perKeypair = ops;
+    size_t n = std::max<size_t>(1, inputs.size());
+    perKeypair.divs /= n;
+    perKeypair.muls /= n;
+    perKeypair.shiftBits /= n;
+    perKeypair.alu /= n;
+    return perKeypair;
+}
+
+void printKeygen(const char* set, const char* engine, double hostUs, const OpCounts& c) {
+    printf("%-9s %-7s %11.3f %8llu %8llu %9llu %8llu %11.2f\n", set, engine, hostUs,
+           (unsigned long long) c.divs, (unsigned long long) c.muls,
+           (unsigned long long) c.shiftBits, (unsigned long long) c.alu,
+           avrCycles(c) / avrHz * 1000);
+}
+
+int keygenBench(unsigned int count) {
+    std::mt19937 rng(config.seed);
+    std::vector<KeygenInput> randomE, fixedE;
+    while (randomE.size() < count) {
+        uint32_t p = hostPrime(14, rng);
+        uint32_t q = hostPrime(15, rng);
+        uint32_t tot = (p-1)*(q-1);
+        randomE.push_back(KeygenInput{tot, (uint32_t) ((rng() & 0x7FFF) | 3)});
+        // e = 17 needs primes where gcd(17, tot) == 1
+        if (board0::gcd_binary(17u, tot) == 1) {
+            fixedE.push_back(KeygenInput{tot, 17});
+        }
+    }
+
+    printf("%u keypairs, e search + private key inverse, per keypair\n", count);
+    printf("AVR estimate: %.0f cycles per / or %%, %.0f per *, %.0f per shifted bit,"
+           " %.0f per add/sub/compare/logic op, at 16 MHz\n",
+           divCycles, mulCycles, shiftBitCycles, aluCycles);
+    printf("%-9s %-7s %11s %8s %8s %9s %8s %11s\n", "e", "engine", "host us",
+           "div/mod", "mul", "shift bit", "alu", "AVR est ms");
+    bool ok = true;
+    const struct {
+        const char* name;
+        const std::vector<KeygenInput>* inputs;
+    } sets[] = {{"random e", &randomE}, {"e=17", &fixedE}};
+    for (const auto& set : sets) {
+        std::vector<uint32_t> euclidKeys, binaryKeys;
+        double euclidUs = timeKeygen<euclidKeygen>(*set.inputs, euclidKeys);
+        double binaryUs = timeKeygen<binaryKeygen<uint32_t> >(*set.inputs, binaryKeys);
+        printKeygen(set.name, "euclid", euclidUs, countKeygen<euclidKeygen>(*set.inputs));
+        printKeygen(set.name, "binary", binaryUs, countKeygen<binaryKeygen<Counted> >(*set.inputs));
+        if (euclidKeys != binaryKeys) {
+            printf("  private keys differ between engines\n");
+            ok = false;
+        }
+    }
+
+    // the same templates on 64-bit operands
+    unsigned int wideErrors = 0;
+    std::mt19937_64 rng64(config.seed);
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t phi = (rng64() >> 2) & ~1ULL;
+        uint64_t e = rng64() | 1;
+        if (board0::gcd_binary(e, phi) != 1) {
+            continue;
+        }
+        uint64_t d = board0::inverse_binary(e, phi);
+        if (d >= phi || (unsigned __int128) e * d % phi != 1) {
+            wideErrors++;
+        }
+    }
+    printf("uint64_t inverse_binary check: %u errors\n", wideErrors);
+    return (ok && wideErrors == 0) ? 0 : 1;
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s [--workload typing|paste] [--chars N] [--cps R] [--baud B]"
+            " [--latency-ms L] [--jitter-ms J] [--drop P] [--cpu-scale S] [--seed X] [--verbose]\n"
+            "       %s --keygen N [--seed X]\n", name, name);
+}
+
+int main(int argc, char** argv) {
+    unsigned int keygenCount = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--workload" && hasValue) {
+            config.workload = argv[++i];
+        } else if (arg == "--chars" && hasValue) {
+            config.chars = atoi(argv[++i]);
+        } else if (arg == "--cps" && hasValue) {
+            config.cps = atof(argv[++i]);
+        } else if (arg == "--baud" && hasValue) {
+            config.baud = atol(argv[++i]);
+        } else if (arg == "--latency-ms" && hasValue) {
+            config.latencyMs = atof(argv[++i]);
+        } else if (arg == "--jitter-ms" && hasValue) {
+            config.jitterMs = atof(argv[++i]);
+        } else if (arg == "--drop" && hasValue) {
+            config.drop = atof(argv[++i]);
+        } else if (arg == "--cpu-scale" && hasValue) {
+            config.cpuScale = atof(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            config.seed = atoi(argv[++i]);
+        } else if (arg == "--keygen" && hasValue) {
+            keygenCount = atoi(argv[++i]);
+        } else if (arg == "--verbose") {
+            config.verbose = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (keygenCount > 0) {
+        return keygenBench(keygenCount);
+    }
+    if ((config.workload != "typing" && config.workload != "paste")
+            || config.baud <= 0 || config.cps <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const Mode modes[] = {
+        {"cold", "full", 0, true, false},
+        {"e=17", "full", 17, false, false},
+        {"e=17", "resume", 17, false, true},
+        {"e=65537", "full", 65537, false, false},
+        {"e=65537", "resume", 65537, false, true},
+        {"random e", "full", 0, false, false},
+        {"random e", "resume", 0, false, true},
+    };
+
+    printf("%s workload, %u chars, %ld baud, latency %.1f ms, jitter %.1f ms, drop %.4f, cpu scale %.0f\n",
+           config.workload.c_str(), config.chars, config.baud, config.latencyMs,
+           config.jitterMs, config.drop, config.cpuScale);
+    if (config.cpuScale == 1) {
+        printf("note: crypto runs at host speed (--cpu-scale 1), so latency and chars/s are set by\n"
+               "      the link and barely differ between crypto modes; --cpu-scale 5000 roughly models a Mega2560\n");
+    }
+    printf("%-9s %-7s %10s %10s %10s %9s %9s %8s %11s %11s %7s %8s %9s\n", "crypto", "link", "keygen ms",
+           "hs cli ms", "hs srv ms", "p50 ms", "p99 ms", "chars/s", "send us/ch", "recv us/ch", "errors",
+           "overflow", "keys lost");
+    for (const Mode& mode : modes) {
+        Result r = runMode(mode);
+        printf("%-9s %-7s %10.1f %10.1f %10.1f %9.2f %9.2f %8.1f %11.2f %11.2f %7zu %8llu %9llu\n",
+               mode.crypto, mode.transport, r.keygenMs, r.clientHandshakeMs, r.serverHandshakeMs,
+               r.p50, r.p99,
+               r.charsPerSecond, r.sendUsPerChar, r.recvUsPerChar, r.errors,
+               (unsigned long long) r.overflowDrops, (unsigned long long) r.keysLost);
+        fflush(stdout);
+    }
+    return 0;
+}
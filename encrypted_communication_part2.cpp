@@ -6,6 +6,7 @@
 */
 
 #include <Arduino.h>
+#include <avr/eeprom.h>
 
 /*
     Generates a random k-bit number up to 2^32-1
@@ -128,26 +129,190 @@ uint32_t totient(uint32_t p, uint32_t q) {
 }
 
 /*
-    Determine the greatest common divior of two integers.
-    IMPORTANT: This function was taken from GCD program posted to eclass.
+    Determine the greatest common divisor of two integers using only shifts
+    and subtraction (binary GCD / Stein's algorithm). Division is a slow
+    software routine on the AVR, so this avoids it entirely.
+
+    T must be an unsigned integer type at least as wide as unsigned int
+    (uint32_t for the keys used here, uint64_t or a multi-precision type
+    with the same operators for wider keys). Only shifts, subtraction and
+    comparisons are used; inverse_binary needs more, see there.
 
     Arguments:
-        a (uint32_t): Integer used in conjunction with b to calculate greatest common divisor
-        b (uint32_t): Integer used in conjunction with a to calculate greatest common divisor
+        a (T): Integer used in conjunction with b to calculate greatest common divisor
+        b (T): Integer used in conjunction with a to calculate greatest common divisor
 
     Returns:
-        a (uint32_t): Greatest common divisor of a and b
+        a (T): Greatest common divisor of a and b
+*/
+template <typename T>
+T gcd_binary(T a, T b) {
+    if (a == 0) {
+        return b;
+    }
+    if (b == 0) {
+        return a;
+    }
+    // factors of two shared by a and b
+    uint8_t shift = 0;
+    while (((a | b) & 1) == 0) {
+        a >>= 1;
+        b >>= 1;
+        shift++;
+    }
+    while ((a & 1) == 0) {
+        a >>= 1;
+    }
+    // a is odd from here on, so factors of two in b never matter
+    do {
+        while ((b & 1) == 0) {
+            b >>= 1;
+        }
+        if (a > b) {
+            T tmp = a;
+            a = b;
+            b = tmp;
+        }
+        b -= a;
+    } while (b != 0);
+    return a << shift;
+}
+
+/*
+    Returns x/2 modulo m, for odd m and x < m
 */
-uint32_t gcd_euclid_fast(uint32_t a, uint32_t b) {
-    while (b > 0) {
-    a %= b;
+template <typename T>
+T half_mod(T x, T m) {
+    if ((x & 1) == 0) {
+        return x >> 1;
+    }
+    // (x + m)/2 without overflowing, both are odd
+    return (x >> 1) + (m >> 1) + 1;
+}
 
-    // now swap them
-    uint32_t tmp = a;
-    a = b;
-    b = tmp;
+/*
+    Returns (x - y) modulo m, for x, y < m
+*/
+template <typename T>
+T sub_mod(T x, T y, T m) {
+    if (x >= y) {
+        return x - y;
     }
-    return a; // b is 0
+    return x + (m - y);
+}
+
+/*
+    Finds the modular inverse of a for an odd modulus m with a binary
+    extended GCD (shifts and subtraction only).
+
+    Arguments:
+        a (T): The integer to invert
+        m (T): The odd modulus
+        inv (T&): Pass-by reference to the inverse, in the range [0, m)
+
+    Returns:
+        true if a has an inverse modulo m, false if not
+*/
+template <typename T>
+bool inverse_mod_odd(T a, T m, T& inv) {
+    if (m == 1) {
+        inv = 0;
+        return true;
+    }
+    // x1*a == u and x2*a == v (mod m) at every step
+    T u = a, v = m;
+    T x1 = 1, x2 = 0;
+    if (u == 0) {
+        return false;
+    }
+    while (u != 1 && v != 1) {
+        while ((u & 1) == 0) {
+            u >>= 1;
+            x1 = half_mod(x1, m);
+        }
+        while ((v & 1) == 0) {
+            v >>= 1;
+            x2 = half_mod(x2, m);
+        }
+        if (u >= v) {
+            u -= v;
+            x1 = sub_mod(x1, x2, m);
+            if (u == 0) {
+                // v is the gcd and it is not 1
+                return false;
+            }
+        } else {
+            v -= u;
+            x2 = sub_mod(x2, x1, m);
+        }
+    }
+    inv = (u == 1) ? x1 : x2;
+    return true;
+}
+
+/*
+    Finds the inverse of an odd integer modulo 2^(sizeof(T)*8) by Newton
+    iteration; each step doubles the number of correct low bits. Relies on
+    T's * and - wrapping modulo 2^(sizeof(T)*8).
+*/
+template <typename T>
+T inverse_mod_pow2(T a) {
+    // a*a == 1 (mod 8) for any odd a, so a is already correct to 3 bits
+    T x = a;
+    for (uint16_t bits = 3; bits < sizeof(T) * 8; bits *= 2) {
+        x *= T(2) - a*x;
+    }
+    return x;
+}
+
+/*
+    Finds the modular inverse of the public key (e) without any division.
+    phi is split into 2^s * o with o odd. The inverse modulo o comes from
+    inverse_mod_odd, the inverse modulo 2^s from inverse_mod_pow2, and the
+    two are joined so the result is already in [0, phi), with no fix-up
+    needed.
+
+    T must be a fixed-width unsigned type whose + - * wrap modulo
+    2^(sizeof(T)*8): uint32_t, uint64_t, or a fixed-width multi-precision
+    type (say a 256-bit unsigned integer class) for wider keys. Both the
+    inverse modulo 2^s and the (d2 - d1) in the join depend on that
+    wrap-around, so an arbitrary-precision integer that grows instead of
+    wrapping cannot be used.
+
+    Arguments:
+        e (T): The public key of the given Arduino
+        phi (T): The totient of two randomly generated prime numbers
+
+    Returns:
+        d (T): The private key, or 0 if e has no inverse modulo phi
+*/
+template <typename T>
+T inverse_binary(T e, T phi) {
+    if (phi == 0) {
+        return 0;
+    }
+    uint8_t s = 0;
+    T o = phi;
+    while ((o & 1) == 0) {
+        o >>= 1;
+        s++;
+    }
+    T d1;
+    if (!inverse_mod_odd(e, o, d1)) {
+        return 0;
+    }
+    if (s == 0) {
+        return d1;
+    }
+    if ((e & 1) == 0) {
+        // an even e has no inverse modulo an even phi
+        return 0;
+    }
+    T mask = (T(1) << s) - 1;
+    T d2 = inverse_mod_pow2(e) & mask;
+    // d = d1 + o*t, where o*t == d2 - d1 (mod 2^s)
+    T t = ((d2 - d1) * inverse_mod_pow2(o)) & mask;
+    return d1 + o*t;
 }
 
 /*
@@ -163,7 +328,7 @@ uint32_t publickey(uint32_t tot) {
     // first, generate a random 15-bit number
     uint32_t pubKey = randomGenerator(15);
     // ensure that the public key satisfies the condition gcd(pubKey, tot) == 1
-    while (gcd_euclid_fast(pubKey, tot) != 1) {
+    while (gcd_binary(pubKey, tot) != 1) {
         // if it doesn't satisfy the condition, keep incrementing until find a number that does
         pubKey++;
         // ensures that the key never exceeds 15 bits
@@ -179,107 +344,138 @@ uint32_t publickey(uint32_t tot) {
 }
 
 /*
-    Finds the modular inverse of the public key (e).
-    IMPORTANT: Adapted from template code given in the Extended Euclidean Algorithm worksheet on eclass
+    Public exponent used by key generation. If 0, a random 15-bit exponent is
+    searched for with publickey(). Otherwise e is fixed to this value and the
+    primes are regenerated until gcd(e, totient) == 1.
+    Use 17 or 65537: they have the form 2^k + 1, so encrypt() only needs k
+    squarings and one multiply. 3 is not allowed since c^3 < n for every
+    character, which would leave the message readable with a cube root.
+*/
+const uint32_t fixedExponent = 17;
+
+/*
+    Generates two primes and the public key for RSA encryption
 
     Arguments:
-        e (uint32_t): The public key of the given Arduino
-        phi (uint32_t): The totient of two randomly generated prime numbers
+        pubKey (uint32_t&): Pass-by reference to the public key
+        mod (uint32_t&): Pass-by reference to the modulus
+        tot (uint32_t&): Pass-by reference to the totient of the two primes
 
     Returns:
-        mod_inv (int32_t): The modular inverse of given public key
-*/
-int32_t ext_euclid(uint32_t e, uint32_t phi) {
-    uint32_t r[40];
-    int32_t s[40];
-    r[0] = e; r[1] = phi;
-    s[0] = 1; s[1] = 0;
-    int i = 1;
-    while (r[i] > 0) {
-        int q = r[i-1]/r[i];
-        r[i+1] = r[i-1] - q*r[i];
-        s[i+1] = s[i-1] - q*s[i];
-        i++;
+        Nothing, simply updates pass-by values
+*/
+void primesAndPublicKey(uint32_t& pubKey, uint32_t& mod, uint32_t& tot) {
+    unsigned int smallprime, biggerprime;
+    if (fixedExponent != 0) {
+        // e is fixed, so regenerate the primes until e is coprime with the totient
+        do {
+            smallprime = primerange(14);
+            biggerprime = primerange(15);
+            tot = totient(smallprime, biggerprime);
+        } while (gcd_binary(fixedExponent, tot) != 1);
+        pubKey = fixedExponent;
+    } else {
+        // generate random prime number between 2^14 and 2^15
+        smallprime = primerange(14);
+        // generate random prime number between 2^15 and 2^16
+        biggerprime = primerange(15);
+        // calculate totient of the two primes, then search for a public key
+        tot = totient(smallprime, biggerprime);
+        pubKey = publickey(tot);
     }
-    int32_t mod_inv = s[i-1];
-    return mod_inv;
+    mod = modulus(smallprime, biggerprime);
 }
 
+// set to false to always generate new keys and do the full key exchange
+const bool keyResumption = true;
+
+// marks a valid KeyCache in EEPROM (blank EEPROM reads as 0xFF)
+const uint16_t keyCacheMagic = 0x5241;
+
 /*
-    Determines the modular equivalent of an integer with a given modulus
+    This Arduino's keys and the partner's public key from the last full
+    handshake. Kept in EEPROM so that after a reset both key generation
+    and the full key exchange can be skipped.
+    Only one role is ever active, so server and client share the same storage.
+*/
+struct KeyCache {
+    uint16_t magic;
+    uint32_t ownPublicKey;
+    uint32_t ownPrivateKey;
+    uint32_t ownModulus;
+    uint32_t peerPublicKey;
+    // 0 if no partner key has been cached yet
+    uint32_t peerModulus;
+};
+
+KeyCache keys;
+
+/*
+    Reads the key cache from the start of EEPROM into keys
+
+    Returns:
+        true if EEPROM held a valid key cache, false if not
+*/
+bool loadKeyCache() {
+    eeprom_read_block(&keys, (const void*) 0, sizeof(keys));
+    return keys.magic == keyCacheMagic;
+}
+
+/*
+    Writes keys to the start of EEPROM, skipping bytes that did not change
+*/
+void saveKeyCache() {
+    keys.magic = keyCacheMagic;
+    eeprom_update_block(&keys, (void*) 0, sizeof(keys));
+}
+
+/*
+    Computes a short fingerprint of a public key (32-bit FNV-1a over e and m)
 
     Arguments:
-        x (int32_t): Integer the modular equivalent is desired from
-        m (uint32_t): Modulus the integer will be reduced with
+        e (uint32_t): The public key
+        m (uint32_t): The modulus
 
     Returns:
-        mod (int32_t): The reduced integer
+        hash (uint32_t): Fingerprint sent during session resumption
 */
-int32_t reduce_mod(int32_t x, uint32_t m) {
-    // if the integer is positive or zero, simply return the x mod m
-    if (x>=0) {
-        int32_t mod = (x%m);
-        return mod;
-    } 
-    // if the integer is negative, find the modular equivalent and return that positive integer
-    else if (x < 0) {
-        uint32_t z = (-x/m) + 1;
-        int32_t mod = ((x+z*m) % m);
-        return mod;
+uint32_t keyFingerprint(uint32_t e, uint32_t m) {
+    uint32_t hash = 2166136261UL;
+    uint32_t words[2] = {e, m};
+    for (uint8_t w = 0; w < 2; w++) {
+        for (uint8_t shift = 0; shift < 32; shift += 8) {
+            hash ^= (uint8_t) (words[w] >> shift);
+            hash *= 16777619UL;
+        }
     }
+    return hash;
 }
 
-// declare variables for server/client keys and moduli
-uint32_t serverPublicKey;
-uint32_t serverPrivateKey;
-uint32_t serverModulus;
-uint32_t clientPublicKey;
-uint32_t clientPrivateKey;
-uint32_t clientModulus;
-
 /*
     Updates keys and modulus.
 
     Arguments:
-        serverPublicKey (uint32_t&): Pass-by reference to server's public key
-        serverPrivateKey (uint32_t&): Pass-by reference to server's private key
-        serverModulus (uint32_t&): Pass-by reference to client's modulus
+        publicKey (uint32_t&): Pass-by reference to this Arduino's public key
+        privateKey (uint32_t&): Pass-by reference to this Arduino's private key
+        mod (uint32_t&): Pass-by reference to this Arduino's modulus
 
     Returns:
         Nothing, simply updates pass-by values
 */
-void serverKeyGeneration(uint32_t& serverPublicKey, uint32_t& serverPrivateKey, uint32_t& serverModulus) {
-    // generate random prime number between 2^14 and 2^15
-    unsigned int smallprime = primerange(14);
-    // generate random prime number between 2^15 and 2^16
-    unsigned int biggerprime = primerange(15);
-    // calculate totient of the two primes
-    uint32_t toti = totient(smallprime,biggerprime);
-    // generates the server's public key
-    serverPublicKey = publickey(toti);
-    // generates server modulus given the two primes
-    serverModulus = modulus(smallprime, biggerprime);
-    // generates the modular inverse of the serverPublicKey
-    int32_t euci = ext_euclid(serverPublicKey, toti);
-    // generates the server's private key by adjusting euci to ensure a positive integer
-    serverPrivateKey = reduce_mod(euci, serverModulus);
-    Serial.println("generated keys for server");
-}
-
-// same as above, but for the client
-void clientKeyGeneration(uint32_t& clientPublicKey, uint32_t& clientPrivateKey, uint32_t& clientModulus) {
-    unsigned int smallprime = primerange(14);
-    unsigned int biggerprime = primerange(15);
-    uint32_t toti = totient(smallprime,biggerprime);
-    clientPublicKey = publickey(toti);
-    clientModulus = modulus(smallprime, biggerprime);
-    int32_t euci = ext_euclid(clientPublicKey, toti);
-    clientPrivateKey = reduce_mod(euci, clientModulus);
-    Serial.println("generated keys for client");
+void keyGeneration(uint32_t& publicKey, uint32_t& privateKey, uint32_t& mod) {
+    uint32_t toti;
+    // generates the public key and modulus
+    primesAndPublicKey(publicKey, mod, toti);
+    // generates the private key, the modular inverse of the publicKey
+    privateKey = inverse_binary(publicKey, toti);
+    Serial.println(F("generated keys"));
 }
 
 const int serverPin = 13;
 
+// 'R' requests the client sends before falling back to the full exchange
+const uint8_t resumeAttempts = 3;
+
 enum StateNames {
     WaitForAck, DataExchange, Listen, WaitForKey
 };
@@ -295,6 +491,76 @@ bool isServer() {
     }
 }
 
+// set to true to print free SRAM after keygen, handshake, at the start of data exchange
+// and each time Enter is pressed during data exchange
+const bool memoryReports = false;
+
+// byte pattern written to unused SRAM by paintStack()
+const uint8_t stackPaint = 0xC5;
+
+// provided by avr-libc: start of the heap and the current end of the heap
+extern uint8_t __heap_start;
+extern uint8_t* __brkval;
+
+/*
+    Returns the lowest address not used by globals or the heap
+*/
+uint8_t* heapEnd() {
+    if (__brkval == 0) {
+        return &__heap_start;
+    }
+    return __brkval;
+}
+
+/*
+    Fills the SRAM between the end of the heap and the current stack frame
+    with stackPaint, so stackHighWater() can later tell how deep the stack went.
+    Should be called once, as early as possible.
+*/
+void paintStack() {
+    uint8_t marker;
+    // leave a small margin below this frame for the loop itself
+    uintptr_t top = (uintptr_t) &marker - 16;
+    for (uint8_t* p = heapEnd(); (uintptr_t) p < top; p++) {
+        *p = stackPaint;
+    }
+}
+
+/*
+    Counts the painted bytes above the heap that the stack has never reached
+
+    Returns:
+        untouched (uint16_t): Smallest amount of free SRAM seen since paintStack()
+*/
+uint16_t stackHighWater() {
+    uint8_t marker;
+    uint16_t untouched = 0;
+    for (uint8_t* p = heapEnd(); (uintptr_t) p < (uintptr_t) &marker && *p == stackPaint; p++) {
+        untouched++;
+    }
+    return untouched;
+}
+
+/*
+    Prints the SRAM currently free between heap and stack, and the lowest
+    free SRAM seen so far, tagged with the given phase name.
+
+    Arguments:
+        phase (const __FlashStringHelper*): Flash-resident name of the phase
+*/
+void reportMemory(const __FlashStringHelper* phase) {
+    if (!memoryReports) {
+        return;
+    }
+    uint8_t marker;
+    Serial.print(F("SRAM after "));
+    Serial.print(phase);
+    Serial.print(F(": free "));
+    Serial.print((uint16_t) ((uintptr_t) &marker - (uintptr_t) heapEnd()));
+    Serial.print(F(", low-water "));
+    Serial.println(stackHighWater());
+}
+
 // All code below until otherwise indicated was taken from the Major Assignment 2 Part 1 Solution posted to eclass
 /*
     Compute and return (a*b)%m
@@ -351,6 +617,46 @@ uint32_t powMod(uint32_t a, uint32_t b, uint32_t m) {
 
 
 
+/*
+    Determines if e is a fixed low Hamming weight exponent of the form 2^k + 1
+
+    Arguments:
+        e (uint32_t): The public key to classify
+
+    Returns:
+        k (uint8_t): k if e == 2^k + 1 (e.g. 4 for 17, 16 for 65537), 0 otherwise
+*/
+uint8_t fermatShift(uint32_t e) {
+    uint32_t t = e - 1;
+    // e - 1 must be a power of two greater than 1
+    if (e < 3 || (t & (t - 1)) != 0) {
+        return 0;
+    }
+    uint8_t k = 0;
+    while (t > 1) {
+        t = (t >> 1);
+        k++;
+    }
+    return k;
+}
+
+
+/*
+    Compute and return (a to the power of 2^k + 1) mod m.
+    Only needs k squarings and a single multiply, compared to powMod which
+    squares once per bit of the exponent and multiplies once per set bit.
+      Example: powModFermat(2, 2, 13) should return 6.
+*/
+uint32_t powModFermat(uint32_t a, uint8_t k, uint32_t m) {
+    uint32_t base = a % m;
+    uint32_t result = base;
+    for (uint8_t i = 0; i < k; i++) {
+        result = multMod(result, result, m);
+    }
+    return multMod(result, base, m);
+}
+
+
 /* Waits for a certain number of bytes on Serial3 or timeout.
     Arguments:
         nbytes: number of bytes needed to read
@@ -405,6 +711,11 @@ uint32_t uint32_from_serial3() {
         The encrypted character (uint32_t)
 */
 uint32_t encrypt(char c, uint32_t e, uint32_t m) {
+    uint8_t k = fermatShift(e);
+    if (k != 0) {
+        // partner uses a fixed exponent 2^k + 1
+        return powModFermat(c, k, m);
+    }
     return powMod(c, e, m);
 }
 
@@ -444,7 +755,7 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
             while (current == Listen) {
                 // wait to receive connection request 'C' on Serial3
                 // reset firstTime variable so that the Server will send its keys
-                Serial.println("Listening");
+                Serial.println(F("Listening"));
                 firstTime = true;
                 if (wait_on_serial3(1, 1000)) {
                     // keeps waiting to read 'C'
@@ -453,28 +764,47 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
                         // if the character read was 'C', continue to next state
                         // otherwise, will keep listening
                         current = WaitForKey;
+                    } else if (readC == 'R' && wait_on_serial3(8, 1000)) {
+                        // resume request: client key fingerprint, then the server
+                        // key fingerprint the client has cached
+                        uint32_t clientPrint = uint32_from_serial3();
+                        uint32_t serverPrint = uint32_from_serial3();
+                        if (keyResumption && keys.peerModulus != 0
+                                && clientPrint == keyFingerprint(keys.peerPublicKey, keys.peerModulus)
+                                && serverPrint == keyFingerprint(d, n)) {
+                            // both sides still hold the keys from last time, skip the exchange
+                            Serial.println(F("Resuming with cached keys"));
+                            Serial3.write('K');
+                            e = keys.peerPublicKey;
+                            m = keys.peerModulus;
+                            current = WaitForAck;
+                        } else {
+                            // mismatch, the client will fall back to the full exchange
+                            Serial3.write('N');
+                        }
                     }
                 }
             }
             while (current == WaitForKey) {
                 // once C received, read client public key (exp and mod)
                 // wait for 1s to read the 8 bytes of the keys
-                Serial.println("Waiting for Key");
+                Serial.println(F("Waiting for Key"));
                 if (wait_on_serial3(8, 1000)) {
                     // if it could read 8 bytes within 1s
                     // first read e, 4 bytes
                     e = uint32_from_serial3();
                     // next read m, 4 bytes
                     m = uint32_from_serial3();
-                    Serial.println("Received keys");
+                    Serial.println(F("Received keys"));
                     if (firstTime) {
                         // if this is the first time you've hit WaitForKey state
                         // prevents the arduino from sending its keys twice
                         // send 'A', then send server public keys
-                        Serial.println("Sending keys");
+                        Serial.println(F("Sending keys"));
                         Serial3.write('A');
                         uint32_to_serial3(d);
                         uint32_to_serial3(n);
+                        firstTime = false;
                     }
                     // move to next state
                     current = WaitForAck;
@@ -486,19 +816,18 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
             }
             while (current == WaitForAck) {
                 // wait for 'A' from client on Serial3
-                Serial.println("Waiting for Ack");
+                Serial.println(F("Waiting for Ack"));
                 if (wait_on_serial3(1, 1000)) {
                     // if it could read a character within 1s
                     char readA = Serial3.read();
                     if (readA == 'A') {
                         // if character was 'A', move to data exchange
-                        Serial.println("Received- Data Exchange Ready");
+                        Serial.println(F("Received- Data Exchange Ready"));
                         current = DataExchange;
                     } else if (readA == 'C') {
-                        // if receives 'C' instead of 'A', read client keys but do not send server keys
+                        // if receives 'C' instead of 'A', read client keys again
                         // if character was 'C', move back to waiting for key state
-                        // firstTime is reset to false so Server will not send its keys again
-                        firstTime = false;
+                        // firstTime is already false if the Server sent its keys, so they are not sent again
                         current = WaitForKey;
                     } else {
                         // if the byte was something other than 'A' or 'C', reset to Listen
@@ -517,8 +846,31 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
         // d, n are client keys
         // e, m are server keys
         current = WaitForAck;
+        if (keyResumption && keys.peerModulus != 0) {
+            // try to resume with the cached server key before doing the full exchange
+            for (uint8_t attempt = 0; attempt < resumeAttempts && current == WaitForAck; attempt++) {
+                Serial.println(F("Resuming"));
+                Serial3.write('R');
+                uint32_to_serial3(keyFingerprint(d, n));
+                uint32_to_serial3(keyFingerprint(keys.peerPublicKey, keys.peerModulus));
+                if (wait_on_serial3(1, 1000)) {
+                    char reply = Serial3.read();
+                    if (reply == 'K') {
+                        // server still has our key, use the cached server key
+                        Serial.println(F("Resumed with cached keys"));
+                        e = keys.peerPublicKey;
+                        m = keys.peerModulus;
+                        Serial3.write('A');
+                        current = DataExchange;
+                    } else if (reply == 'N') {
+                        // fingerprints did not match, do the full exchange
+                        break;
+                    }
+                }
+            }
+        }
         while (current == WaitForAck) {
-            Serial.println("Waiting for Ack");
+            Serial.println(F("Waiting for Ack"));
             // if you haven't already received 'A'
             // keep sending 'C' and client keys
             Serial3.write('C');
@@ -531,7 +883,7 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
                 if (readA == 'A' && wait_on_serial3(8, 1000)) {
                     // if character read was A and client could read 8 bytes in time
                     // read server keys
-                    Serial.println("Received- reading keys");
+                    Serial.println(F("Received- reading keys"));
                     e = uint32_from_serial3();
                     m = uint32_from_serial3();
                     // send 'A' back
@@ -545,6 +897,21 @@ void handshake(uint32_t d, uint32_t n, uint32_t arr[]) {
     if (current == DataExchange) {
         arr[0] = e;
         arr[1] = m;
+        // remember the partner's key for the next reset
+        if (keyResumption && (keys.peerPublicKey != e || keys.peerModulus != m)) {
+            keys.peerPublicKey = e;
+            keys.peerModulus = m;
+            saveKeyCache();
+        }
+        // the partner's exponent decides which encrypt path is used; a random
+        // exponent can also happen to be 2^k + 1, so report k rather than the mode
+        uint8_t k = fermatShift(e);
+        if (k != 0) {
+            Serial.print(F("Partner exponent is 2^k+1, k = "));
+            Serial.println((int) k);
+        } else {
+            Serial.println(F("Partner exponent is not 2^k+1, using powMod"));
+        }
     }
 }
 
@@ -559,6 +926,8 @@ void communication(uint32_t d, uint32_t n, uint32_t e, uint32_t m) {
         Serial3.read();
     }
 
+    reportMemory(F("data exchange start"));
+
     // Enter the communication loop
     while (true) {
         // Check if the other Arduino sent an encrypted message.
@@ -579,6 +948,8 @@ void communication(uint32_t d, uint32_t n, uint32_t e, uint32_t m) {
                 uint32_to_serial3(encrypt('\r', e, m));
                 Serial.print('\n');
                 uint32_to_serial3(encrypt('\n', e, m));
+                // the low-water mark now covers the encrypts and decrypts done so far
+                reportMemory(F("data exchange"));
             } else {
                 Serial.print(byteRead);
                 uint32_to_serial3(encrypt(byteRead, e, m));
@@ -593,10 +964,11 @@ void communication(uint32_t d, uint32_t n, uint32_t e, uint32_t m) {
 */
 void setup() {
     init();
+    paintStack();
     Serial.begin(9600);
     Serial3.begin(9600);
 
-    Serial.println("Welcome to Arduino Chat!");
+    Serial.println(F("Welcome to Arduino Chat!"));
 }
 
 
@@ -607,34 +979,36 @@ int main() {
     setup();
     uint32_t d, n, e, m;
     uint32_t keyArray[2];
-    uint32_t Key, Mod;
 
     // Determine our role and the encryption keys.
     if (isServer()) {
-        Serial.println("Server");
-        // generate keys for server
-        serverKeyGeneration(serverPublicKey, serverPrivateKey, serverModulus);
-        d = serverPrivateKey;
-        n = serverModulus;
-        // e = clientPublicKey;
-        // m = clientModulus;
-        Key = serverPublicKey;
-        Mod = n;
+        Serial.println(F("Server"));
+    } else {
+        Serial.println(F("Client"));
+    }
+    if (keyResumption && loadKeyCache()) {
+        Serial.println(F("Loaded keys from EEPROM"));
     } else {
-        Serial.println("Client");
-        // generate keys for client
-        clientKeyGeneration(clientPublicKey, clientPrivateKey, clientModulus);
-        d = clientPrivateKey;
-        n = clientModulus;
-        // e = serverPublicKey;
-        // m = serverModulus;
-        Key = clientPublicKey;
-        Mod = n;
+        // generate keys for this Arduino
+        keyGeneration(keys.ownPublicKey, keys.ownPrivateKey, keys.ownModulus);
+        keys.peerPublicKey = 0;
+        keys.peerModulus = 0;
+        if (keyResumption) {
+            saveKeyCache();
+        }
     }
+    reportMemory(F("keygen"));
+    d = keys.ownPrivateKey;
+    n = keys.ownModulus;
     // Perform Handshake
-    handshake(Key, Mod, keyArray);
+    handshake(keys.ownPublicKey, keys.ownModulus, keyArray);
     e = keyArray[0];
     m = keyArray[1];
+    // time to first message after a reset, to compare resumed and full handshakes
+    Serial.print(F("Ready after "));
+    Serial.print(millis());
+    Serial.println(F(" ms"));
+    reportMemory(F("handshake"));
     // Now enter the communication phase.
     communication(d, n, e, m);
     Serial.flush();
@@ -0,0 +1,1167 @@
+/*
+    Encrypted Arduino Communication - Host Gateway
+    CMPUT 274 Fall 2019
+
+    Runs the server side of handshake()/communication() on a Linux host for
+    many boards at once. Each connected board is one session; everything a
+    board sends during data exchange is decrypted and echoed back encrypted
+    with that board's public key.
+
+    Sessions are driven by a single epoll reactor with non-blocking I/O. The
+    modular exponentiation for each batch of blocks runs on a worker pool, so
+    a slow decryption never stalls the reactor.
+
+    Build (host only, not part of the Arduino Makefile):
+        g++ -std=c++11 -O2 -pthread -I../bench -o gateway gateway.cpp
+
+    Usage:
+        ./gateway --pty N              serve N pseudo-terminals (paths printed at startup)
+        ./gateway --unix PATH          serve boards connected to a Unix-domain socket
+        ./gateway --sim N              run N simulated sessions and report throughput
+        ./gateway --sim N --sweep      repeat the simulation for 1, 2, 4, ... workers
+        ./gateway --selftest           check handshakes and board resets over a pty
+
+    Options:
+        --workers W                    worker threads (default: number of cores)
+        --concurrency C                simulated sessions open at once (default 256)
+        --blocks B                     blocks each simulated session sends (default 64)
+        --verbose                      print decrypted text from real boards
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+    The crypto routines are the sketch's own, compiled against the host
+    stand-in for the Arduino core in ../bench, so the gateway does exactly
+    the work per block that a board does.
+*/
+namespace sketch {
+#include "../encrypted_communication_part2.cpp"
+uint8_t __heap_start;
+uint8_t* __brkval;
+}
+
+/*
+    The gateway only calls the sketch's key generation and crypto routines,
+    never its setup() or main(), so the board I/O is stubbed out. The noise
+    randomGenerator() samples from A1 comes from a host RNG instead; keys are
+    only generated on the main thread.
+*/
+std::mt19937 analogNoise(std::random_device{}());
+
+void init() {}
+void pinMode(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return LOW; }
+int analogRead(uint8_t) { return (int) (analogNoise() & 1023); }
+unsigned long millis() { return 0; }
+void delay(unsigned long) {}
+
+void ConsolePort::begin(long) {}
+int ConsolePort::available() { return 0; }
+int ConsolePort::read() { return -1; }
+void ConsolePort::print(const __FlashStringHelper*) {}
+void ConsolePort::print(char) {}
+void ConsolePort::print(int) {}
+void ConsolePort::print(unsigned int) {}
+void ConsolePort::print(long) {}
+void ConsolePort::print(unsigned long) {}
+void ConsolePort::println(const __FlashStringHelper*) {}
+void ConsolePort::println(int) {}
+void ConsolePort::println(unsigned int) {}
+void ConsolePort::println(long) {}
+void ConsolePort::println(unsigned long) {}
+void ConsolePort::println() {}
+void ConsolePort::flush() {}
+
+void LinkPort::begin(long) {}
+int LinkPort::available() { return 0; }
+int LinkPort::read() { return -1; }
+void LinkPort::write(uint8_t) {}
+
+ConsolePort Serial;
+LinkPort Serial3;
+
+// blank EEPROM, so the sketch never finds a key cache
+void eeprom_read_block(void* dst, const void*, size_t n) { memset(dst, 0xFF, n); }
+void eeprom_update_block(const void*, void*, size_t) {}
+
+struct KeyPair {
+    uint32_t e, d, n;
+};
+
+// Generates a keypair with the sketch's keyGeneration()
+KeyPair keyGeneration() {
+    KeyPair key;
+    sketch::keyGeneration(key.e, key.d, key.n);
+    return key;
+}
+
+/*
+    Byte helpers matching uint32_to_serial3/uint32_from_serial3
+    (least-significant byte first)
+*/
+void appendUint32(std::string& buf, uint32_t num) {
+    buf += (char) (num >> 0);
+    buf += (char) (num >> 8);
+    buf += (char) (num >> 16);
+    buf += (char) (num >> 24);
+}
+
+uint32_t readUint32(const std::string& buf, size_t pos) {
+    uint32_t num = 0;
+    for (int i = 0; i < 4; i++) {
+        num |= ((uint32_t) (uint8_t) buf[pos + i]) << (8*i);
+    }
+    return num;
+}
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    size_t idx = (size_t) (p * (v.size() - 1));
+    return v[idx];
+}
+
+
+/*
+    Gateway: epoll reactor plus worker pool
+*/
+
+// same states as the server side of handshake()
+using sketch::StateNames;
+using sketch::WaitForAck;
+using sketch::DataExchange;
+using sketch::Listen;
+using sketch::WaitForKey;
+
+// time handshake() waits in one state before going back to Listen
+const std::chrono::milliseconds stateTimeout(1000);
+
+// boards whose keys are remembered for resumption; the cache starts over past this
+const size_t knownBoardLimit = 4096;
+
+struct Session {
+    uint64_t id;
+    int fd;
+    bool realBoard;
+    StateNames state;
+    bool firstTime;
+    // WaitForKey is reading the fingerprints of an 'R' rather than the keys of a 'C'
+    bool resuming;
+    // partner's public key
+    uint32_t e, m;
+    std::string in, out;
+    bool wantWrite;
+    // a batch of blocks is with the workers; later blocks wait in 'in'
+    bool busy;
+    bool closed;
+    Clock::time_point stateSince;
+};
+
+struct Job {
+    uint64_t session;
+    std::string blocks;
+    uint32_t e, m;
+};
+
+struct Done {
+    uint64_t session;
+    std::string reply;
+    std::string text;
+    // the batch from the first block that did not decrypt to a character on,
+    // empty if every block did
+    std::string rest;
+};
+
+class Gateway {
+public:
+    Gateway(unsigned int workers, const KeyPair& key, bool verbose)
+        : key(key), verbose(verbose), workerCount(workers) {
+        for (int b = 0; b < 128; b++) {
+            highChars[b] = (uint32_t) (int32_t) (int8_t) (b + 128) % key.n;
+        }
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        watch(wakefd, wakeId, EPOLLIN);
+    }
+
+    ~Gateway() {
+        stop();
+        for (auto& it : sessions) {
+            if (!it.second->closed) {
+                close(it.second->fd);
+            }
+        }
+        if (listenfd >= 0) {
+            close(listenfd);
+        }
+        close(wakefd);
+        close(epfd);
+    }
+
+    bool listenUnix(const char* path) {
+        listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if (listenfd < 0 || bind(listenfd, (sockaddr*) &addr, sizeof(addr)) != 0
+                || listen(listenfd, SOMAXCONN) != 0) {
+            perror("unix socket");
+            return false;
+        }
+        watch(listenfd, listenId, EPOLLIN);
+        return true;
+    }
+
+    // Opens a pseudo-terminal in raw mode and returns the path boards should use
+    std::string openPty() {
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            perror("pty");
+            return "";
+        }
+        std::string path = ptsname(master);
+        // keep the slave open so the master never reports EIO while no board is attached
+        int slave = open(path.c_str(), O_RDWR | O_NOCTTY);
+        termios tio;
+        if (slave >= 0 && tcgetattr(slave, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(slave, TCSANOW, &tio);
+        }
+        ptySlaves.push_back(slave);
+        addSession(master, true);
+        return path;
+    }
+
+    // Hands a connected fd to the reactor; safe to call from any thread
+    void adopt(int fd) {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            adopted.push_back(fd);
+        }
+        wake();
+    }
+
+    void start() {
+        stopping = false;
+        for (unsigned int i = 0; i < workerCount; i++) {
+            workers.push_back(std::thread(&Gateway::workerLoop, this));
+        }
+        reactor = std::thread(&Gateway::reactorLoop, this);
+    }
+
+    void stop() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        wake();
+        jobsReady.notify_all();
+        if (reactor.joinable()) {
+            reactor.join();
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+        workers.clear();
+        for (int fd : ptySlaves) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        ptySlaves.clear();
+    }
+
+    std::atomic<uint64_t> handshakes{0};
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> activeSessions{0};
+    // sessions sent back to Listen after a board reset mid data exchange
+    std::atomic<uint64_t> resyncs{0};
+    // handshakes that skipped the key exchange with 'R'/'K'
+    std::atomic<uint64_t> resumes{0};
+
+private:
+    static const uint64_t wakeId = 1;
+    static const uint64_t listenId = 2;
+
+    void watch(int fd, uint64_t id, uint32_t events) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.u64 = id;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakefd, &one, sizeof(one));
+        (void) ignored;
+    }
+
+    void addSession(int fd, bool realBoard) {
+        std::unique_ptr<Session> s(new Session());
+        s->id = nextId++;
+        s->fd = fd;
+        s->realBoard = realBoard;
+        s->state = Listen;
+        s->firstTime = true;
+        s->resuming = false;
+        s->e = s->m = 0;
+        s->wantWrite = false;
+        s->busy = false;
+        s->closed = false;
+        s->stateSince = Clock::now();
+        watch(fd, s->id, EPOLLIN | EPOLLRDHUP);
+        sessions[s->id] = std::move(s);
+        activeSessions++;
+    }
+
+    void closeSession(Session& s) {
+        if (!s.closed) {
+            close(s.fd);
+            s.closed = true;
+            activeSessions--;
+        }
+        // a session with a job in flight is erased once the job comes back
+        if (!s.busy) {
+            sessions.erase(s.id);
+        }
+    }
+
+    void setState(Session& s, StateNames state) {
+        s.state = state;
+        s.stateSince = Clock::now();
+        s.resuming = false;
+        if (state == Listen) {
+            s.firstTime = true;
+        }
+    }
+
+    /*
+        Server side of handshake() as a state machine over the bytes received
+        so far, followed by batching data exchange blocks to the workers.
+    */
+    void process(Session& s) {
+        size_t pos = 0;
+        bool progress = true;
+        while (progress && !s.closed) {
+            progress = false;
+            if (s.state == Listen && pos < s.in.size()) {
+                // wait to receive connection request 'C' or resume request 'R'
+                char readC = s.in[pos++];
+                if (readC == 'C') {
+                    setState(s, WaitForKey);
+                } else if (readC == 'R') {
+                    setState(s, WaitForKey);
+                    s.resuming = true;
+                }
+                progress = true;
+            } else if (s.state == WaitForKey && s.resuming && s.in.size() - pos >= 8) {
+                // client key fingerprint, then the gateway key fingerprint the client has cached
+                uint32_t clientPrint = readUint32(s.in, pos);
+                uint32_t serverPrint = readUint32(s.in, pos + 4);
+                pos += 8;
+                auto known = knownBoards.find(clientPrint);
+                if (known != knownBoards.end() && serverPrint == sketch::keyFingerprint(key.e, key.n)) {
+                    // both sides still hold the keys from last time, skip the exchange
+                    s.out += 'K';
+                    s.e = known->second.first;
+                    s.m = known->second.second;
+                    setState(s, WaitForAck);
+                    resumes++;
+                } else {
+                    // the client will fall back to the full exchange
+                    s.out += 'N';
+                    setState(s, Listen);
+                }
+                progress = true;
+            } else if (s.state == WaitForKey && s.in.size() - pos >= 8) {
+                s.e = readUint32(s.in, pos);
+                s.m = readUint32(s.in, pos + 4);
+                pos += 8;
+                if (s.firstTime) {
+                    s.out += 'A';
+                    appendUint32(s.out, key.e);
+                    appendUint32(s.out, key.n);
+                    s.firstTime = false;
+                }
+                setState(s, WaitForAck);
+                progress = true;
+            } else if (s.state == WaitForAck && pos < s.in.size()) {
+                char readA = s.in[pos++];
+                if (readA == 'A') {
+                    setState(s, DataExchange);
+                    handshakes++;
+                    // remember the board's key so it can resume after a reset
+                    if (knownBoards.size() >= knownBoardLimit) {
+                        knownBoards.clear();
+                    }
+                    knownBoards[sketch::keyFingerprint(s.e, s.m)] = std::make_pair(s.e, s.m);
+                } else if (readA == 'C') {
+                    // partner resent its keys, read them; ours are only sent
+                    // again if they were not sent yet (a 'K' sends none)
+                    setState(s, WaitForKey);
+                } else {
+                    setState(s, Listen);
+                }
+                progress = true;
+            }
+        }
+        if (s.state == DataExchange && !s.busy && s.in.size() - pos >= 4) {
+            size_t len = (s.in.size() - pos) / 4 * 4;
+            Job job;
+            job.session = s.id;
+            job.blocks = s.in.substr(pos, len);
+            job.e = s.e;
+            job.m = s.m;
+            pos += len;
+            s.busy = true;
+            submit(std::move(job));
+        }
+        s.in.erase(0, pos);
+        flush(s);
+    }
+
+    void flush(Session& s) {
+        if (s.closed) {
+            return;
+        }
+        while (!s.out.empty()) {
+            ssize_t w = write(s.fd, s.out.data(), s.out.size());
+            if (w > 0) {
+                s.out.erase(0, w);
+            } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (w < 0 && errno == EINTR) {
+                continue;
+            } else {
+                closeSession(s);
+                return;
+            }
+        }
+        bool want = !s.out.empty();
+        if (want != s.wantWrite) {
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP | (want ? (uint32_t) EPOLLOUT : 0);
+            ev.data.u64 = s.id;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, s.fd, &ev);
+            s.wantWrite = want;
+        }
+    }
+
+    void readable(Session& s) {
+        char buf[4096];
+        while (true) {
+            ssize_t r = read(s.fd, buf, sizeof(buf));
+            if (r > 0) {
+                s.in.append(buf, r);
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                // EOF or error: the board went away
+                closeSession(s);
+                return;
+            }
+        }
+        process(s);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            addSession(fd, true);
+        }
+    }
+
+    // handshake() gives up on a state after a second without the expected bytes
+    // bytes already received stay queued and are scanned for the next 'C' or 'R'
+    void expireStalled() {
+        Clock::time_point now = Clock::now();
+        std::vector<uint64_t> stalled;
+        for (auto& it : sessions) {
+            Session& s = *it.second;
+            if ((s.state == WaitForKey || s.state == WaitForAck)
+                    && now - s.stateSince > stateTimeout) {
+                setState(s, Listen);
+                stalled.push_back(s.id);
+            }
+        }
+        for (uint64_t id : stalled) {
+            auto it = sessions.find(id);
+            if (it != sessions.end() && !it->second->closed) {
+                process(*it->second);
+            }
+        }
+    }
+
+    void drainQueues() {
+        uint64_t count;
+        ssize_t ignored = read(wakefd, &count, sizeof(count));
+        (void) ignored;
+
+        std::vector<int> fds;
+        std::vector<Done> finished;
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            fds.swap(adopted);
+            finished.swap(completed);
+        }
+        for (int fd : fds) {
+            addSession(fd, false);
+        }
+        for (Done& d : finished) {
+            auto it = sessions.find(d.session);
+            if (it == sessions.end()) {
+                continue;
+            }
+            Session& s = *it->second;
+            s.busy = false;
+            if (s.closed) {
+                sessions.erase(it);
+                continue;
+            }
+            blocks += d.reply.size() / 4;
+            if (verbose && s.realBoard) {
+                printf("[session %llu] %s\n", (unsigned long long) s.id, d.text.c_str());
+                fflush(stdout);
+            }
+            s.out += d.reply;
+            if (!d.rest.empty()) {
+                // data exchange lost alignment; put the bytes back and look
+                // for the connection request in them, as a freshly reset
+                // server would
+                s.in.insert(0, d.rest);
+                setState(s, Listen);
+                resyncs++;
+                if (verbose && s.realBoard) {
+                    printf("[session %llu] board reset, listening again\n", (unsigned long long) s.id);
+                    fflush(stdout);
+                }
+            }
+            // blocks that arrived while this batch was out are still in 'in'
+            process(s);
+        }
+    }
+
+    void reactorLoop() {
+        epoll_event events[256];
+        Clock::time_point lastSweep = Clock::now();
+        while (!stopping) {
+            int n = epoll_wait(epfd, events, 256, 100);
+            for (int i = 0; i < n; i++) {
+                uint64_t id = events[i].data.u64;
+                if (id == wakeId) {
+                    drainQueues();
+                    continue;
+                }
+                if (id == listenId) {
+                    acceptAll();
+                    continue;
+                }
+                auto it = sessions.find(id);
+                if (it == sessions.end() || it->second->closed) {
+                    continue;
+                }
+                Session& s = *it->second;
+                if (events[i].events & EPOLLOUT) {
+                    flush(s);
+                    if (sessions.count(id) == 0 || s.closed) {
+                        continue;
+                    }
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    readable(s);
+                }
+            }
+            if (Clock::now() - lastSweep > std::chrono::milliseconds(100)) {
+                expireStalled();
+                lastSweep = Clock::now();
+            }
+        }
+    }
+
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(jobLock);
+            jobs.push_back(std::move(job));
+        }
+        jobsReady.notify_one();
+    }
+
+    /*
+        Maps a decrypted block back to the byte the board typed. A board's
+        encrypt() takes a signed char, so bytes 0x80-0xFF arrive as the
+        sign-extended value reduced mod n rather than as 128-255.
+        Returns false if the block is not a character at all.
+    */
+    bool boardChar(uint32_t x, char& c) const {
+        if (x <= 255) {
+            c = (char) x;
+            return true;
+        }
+        for (int b = 0; b < 128; b++) {
+            if (x == highChars[b]) {
+                c = (char) (b + 128);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobLock);
+                jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            Done done;
+            done.session = job.session;
+            for (size_t pos = 0; pos + 4 <= job.blocks.size(); pos += 4) {
+                char c;
+                if (!boardChar(sketch::powMod(readUint32(job.blocks, pos), key.d, key.n), c)) {
+                    // not a block we encrypted for: the board has reset and
+                    // these bytes are its next 'C' and keys
+                    done.rest = job.blocks.substr(pos);
+                    break;
+                }
+                if (verbose) {
+                    done.text += c;
+                }
+                appendUint32(done.reply, sketch::encrypt(c, job.e, job.m));
+            }
+            {
+                std::lock_guard<std::mutex> lock(queueLock);
+                completed.push_back(std::move(done));
+            }
+            wake();
+        }
+    }
+
+    KeyPair key;
+    // plaintexts of a board's bytes 0x80-0xFF, see boardChar()
+    uint32_t highChars[128];
+    bool verbose;
+    unsigned int workerCount;
+    int epfd;
+    int wakefd;
+    int listenfd = -1;
+    uint64_t nextId = 16;
+    std::unordered_map<uint64_t, std::unique_ptr<Session>> sessions;
+    // board key fingerprint -> board public key, from completed handshakes
+    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> knownBoards;
+    std::vector<int> ptySlaves;
+
+    std::atomic<bool> stopping{true};
+    std::thread reactor;
+    std::vector<std::thread> workers;
+
+    std::mutex jobLock;
+    std::condition_variable jobsReady;
+    std::deque<Job> jobs;
+
+    std::mutex queueLock;
+    std::vector<int> adopted;
+    std::vector<Done> completed;
+};
+
+
+/*
+    Simulated boards: the client side of handshake() and communication()
+    on socketpairs handed to the gateway.
+*/
+
+// the simulated typing alphabet
+const char simText[] = "the quick brown fox jumps over the lazy dog\r\n";
+const size_t simTextLen = sizeof(simText) - 1;
+
+// A simulated board's keypair plus ciphertext tables, so the load
+// generator spends no time on exponentiation of its own
+struct SimKey {
+    KeyPair key;
+    // encrypt(c, key.e, key.n) for every byte: what the gateway echoes back
+    uint32_t echo[256];
+};
+
+struct SimClient {
+    int fd;
+    const SimKey* key;
+    bool handshakeDone;
+    size_t sent, received;
+    std::string in, out;
+    Clock::time_point start;
+};
+
+struct SimResult {
+    double seconds;
+    uint64_t sessions;
+    uint64_t blocks;
+    uint64_t errors;
+    std::vector<double> handshakeMs;
+};
+
+/*
+    Runs total sessions through the gateway, at most concurrency open at once.
+    Each session completes the handshake, sends blockCount blocks and checks
+    every echoed block before closing.
+*/
+SimResult simulate(Gateway& gateway, const KeyPair& gatewayKey, const std::vector<SimKey>& keys,
+                   unsigned int total, unsigned int concurrency, unsigned int blockCount) {
+    // what a board sends for each character: encrypt(c, gateway e, gateway n)
+    uint32_t toGateway[256];
+    for (int c = 0; c < 256; c++) {
+        toGateway[c] = sketch::encrypt((char) c, gatewayKey.e, gatewayKey.n);
+    }
+
+    SimResult result;
+    result.sessions = result.blocks = result.errors = 0;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    std::unordered_map<int, SimClient> clients;
+    unsigned int started = 0;
+    // blocks kept in flight per session, like a fast typist
+    const size_t window = 8;
+
+    auto flushClient = [&](SimClient& c) {
+        while (!c.out.empty()) {
+            ssize_t w = write(c.fd, c.out.data(), c.out.size());
+            if (w <= 0) {
+                break;
+            }
+            c.out.erase(0, w);
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN | (c.out.empty() ? 0 : (uint32_t) EPOLLOUT);
+        ev.data.fd = c.fd;
+        epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+    };
+
+    auto openClient = [&]() {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) != 0) {
+            perror("socketpair");
+            result.errors++;
+            return;
+        }
+        SimClient& c = clients[sv[0]];
+        c.fd = sv[0];
+        c.key = &keys[started % keys.size()];
+        c.handshakeDone = false;
+        c.sent = c.received = 0;
+        c.start = Clock::now();
+        // 'C' followed by this board's public key
+        c.out += 'C';
+        appendUint32(c.out, c.key->key.e);
+        appendUint32(c.out, c.key->key.n);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = c.fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+        gateway.adopt(sv[1]);
+        started++;
+        flushClient(c);
+    };
+
+    auto fill = [&](SimClient& c) {
+        while (c.sent < blockCount && c.sent - c.received < window) {
+            appendUint32(c.out, toGateway[(uint8_t) simText[c.sent % simTextLen]]);
+            c.sent++;
+        }
+    };
+
+    Clock::time_point begin = Clock::now();
+    while (started < total && clients.size() < concurrency) {
+        openClient();
+    }
+
+    epoll_event events[256];
+    while (!clients.empty()) {
+        int n = epoll_wait(ep, events, 256, 1000);
+        if (n == 0) {
+            fprintf(stderr, "simulation stalled with %zu sessions open\n", clients.size());
+            result.errors += clients.size();
+            for (auto& it : clients) {
+                close(it.first);
+            }
+            clients.clear();
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            auto it = clients.find(events[i].data.fd);
+            if (it == clients.end()) {
+                continue;
+            }
+            SimClient& c = it->second;
+            bool finished = false;
+            if (events[i].events & EPOLLIN) {
+                char buf[4096];
+                ssize_t r;
+                while ((r = read(c.fd, buf, sizeof(buf))) > 0) {
+                    c.in.append(buf, r);
+                }
+                if (r == 0) {
+                    result.errors++;
+                    finished = true;
+                }
+            }
+            if (!finished && !c.handshakeDone && c.in.size() >= 9) {
+                if (c.in[0] != 'A') {
+                    result.errors++;
+                    finished = true;
+                } else {
+                    c.in.erase(0, 9);
+                    c.out += 'A';
+                    c.handshakeDone = true;
+                    result.handshakeMs.push_back(
+                        std::chrono::duration<double, std::milli>(Clock::now() - c.start).count());
+                }
+            }
+            if (!finished && c.handshakeDone) {
+                size_t pos = 0;
+                for (; pos + 4 <= c.in.size(); pos += 4) {
+                    uint8_t expected = simText[c.received % simTextLen];
+                    if (readUint32(c.in, pos) != c.key->echo[expected]) {
+                        result.errors++;
+                    }
+                    c.received++;
+                    result.blocks++;
+                }
+                c.in.erase(0, pos);
+                if (c.received >= blockCount) {
+                    result.sessions++;
+                    finished = true;
+                } else {
+                    fill(c);
+                }
+            }
+            if (finished) {
+                close(c.fd);
+                clients.erase(it);
+                if (started < total) {
+                    openClient();
+                }
+                continue;
+            }
+            flushClient(c);
+        }
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    close(ep);
+    return result;
+}
+
+void printResult(unsigned int workers, const SimResult& r) {
+    printf("%7u %10.1f %9.2f %9.2f %12.0f %7llu\n", workers,
+           r.sessions / r.seconds,
+           percentile(r.handshakeMs, 0.5), percentile(r.handshakeMs, 0.99),
+           r.blocks / r.seconds, (unsigned long long) r.errors);
+}
+
+/*
+    Self test over a real pseudo-terminal: plays one board through a
+    handshake and some data exchange, then resets it twice (a new 'C'
+    handshake with fresh keys, once on a block boundary and once part way
+    through a block) and checks the gateway follows each time. Then checks
+    that a reset board holding cached keys resumes with 'R', and that an
+    unknown board is refused with 'N' and can still do the full exchange.
+*/
+
+// Writes all of buf to a blocking fd
+bool writeAll(int fd, const std::string& buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t w = write(fd, buf.data() + done, buf.size() - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        done += w;
+    }
+    return true;
+}
+
+// Reads exactly n bytes into buf, giving up after timeoutMs without data
+bool readExact(int fd, std::string& buf, size_t n, int timeoutMs) {
+    buf.clear();
+    char tmp[256];
+    while (buf.size() < n) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeoutMs) <= 0) {
+            return false;
+        }
+        ssize_t r = read(fd, tmp, std::min(sizeof(tmp), n - buf.size()));
+        if (r <= 0) {
+            return false;
+        }
+        buf.append(tmp, r);
+    }
+    return true;
+}
+
+// Client side of handshake(): 'C' and keys, expect 'A' and the gateway keys, send 'A'
+bool boardHandshake(int fd, const KeyPair& board, const KeyPair& gatewayKey) {
+    std::string msg = "C", reply;
+    appendUint32(msg, board.e);
+    appendUint32(msg, board.n);
+    if (!writeAll(fd, msg) || !readExact(fd, reply, 9, 2000)) {
+        return false;
+    }
+    if (reply[0] != 'A' || readUint32(reply, 1) != gatewayKey.e || readUint32(reply, 5) != gatewayKey.n) {
+        return false;
+    }
+    return writeAll(fd, "A");
+}
+
+// Client side of a resume: 'R' and fingerprints, expect reply; on 'K' send 'A'
+bool boardResume(int fd, const KeyPair& board, const KeyPair& gatewayKey, char expected) {
+    std::string msg = "R", reply;
+    appendUint32(msg, sketch::keyFingerprint(board.e, board.n));
+    appendUint32(msg, sketch::keyFingerprint(gatewayKey.e, gatewayKey.n));
+    if (!writeAll(fd, msg) || !readExact(fd, reply, 1, 2000) || reply[0] != expected) {
+        return false;
+    }
+    return expected != 'K' || writeAll(fd, "A");
+}
+
+// Sends text encrypted for the gateway and checks it comes back encrypted for
+// the board exactly as the board's partner would have encrypted it
+bool boardEcho(int fd, const KeyPair& board, const KeyPair& gatewayKey, const std::string& text) {
+    std::string msg, reply;
+    for (char c : text) {
+        appendUint32(msg, sketch::encrypt(c, gatewayKey.e, gatewayKey.n));
+    }
+    if (!writeAll(fd, msg) || !readExact(fd, reply, msg.size(), 2000)) {
+        return false;
+    }
+    for (size_t i = 0; i < text.size(); i++) {
+        if (readUint32(reply, 4*i) != sketch::encrypt(text[i], board.e, board.n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int selftest(unsigned int workers) {
+    KeyPair gatewayKey = keyGeneration();
+    Gateway gateway(workers, gatewayKey, false);
+    std::string path = gateway.openPty();
+    if (path.empty()) {
+        return 1;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(path.c_str());
+        return 1;
+    }
+    gateway.start();
+
+    bool ok = true;
+    auto check = [&ok](const char* step, bool passed) {
+        printf("%-44s %s\n", step, passed ? "ok" : "FAILED");
+        ok = ok && passed;
+    };
+
+    KeyPair board = keyGeneration();
+    check("handshake", boardHandshake(fd, board, gatewayKey));
+    check("data exchange", boardEcho(fd, board, gatewayKey, "hello\r\n"));
+    // UTF-8 "café": bytes 0x80-0xFF are not a reset
+    check("data exchange with bytes >= 0x80", boardEcho(fd, board, gatewayKey, "caf\xc3\xa9\r\n"));
+
+    // the board resets between blocks and comes back with new keys
+    board = keyGeneration();
+    check("reset on a block boundary: handshake", boardHandshake(fd, board, gatewayKey));
+    check("reset on a block boundary: data exchange", boardEcho(fd, board, gatewayKey, "again\r\n"));
+
+    // the board resets after sending half a block; pick a block whose first
+    // half holds no 'C', which the gateway would take as the request
+    std::string half;
+    for (char c = 'a'; c <= 'z' && half.empty(); c++) {
+        appendUint32(half, sketch::encrypt(c, gatewayKey.e, gatewayKey.n));
+        half.resize(2);
+        if (half.find('C') != std::string::npos) {
+            half.clear();
+        }
+    }
+    board = keyGeneration();
+    check("reset mid block: handshake", writeAll(fd, half) && boardHandshake(fd, board, gatewayKey));
+    check("reset mid block: data exchange", boardEcho(fd, board, gatewayKey, "and again\r\n"));
+
+    // the board resets and resumes with the keys it cached in EEPROM
+    check("reset with cached keys: resume", boardResume(fd, board, gatewayKey, 'K'));
+    check("reset with cached keys: data exchange", boardEcho(fd, board, gatewayKey, "resumed\r\n"));
+
+    // a board the gateway has never seen falls back to the full exchange
+    KeyPair stranger = keyGeneration();
+    check("unknown board: resume refused", boardResume(fd, stranger, gatewayKey, 'N'));
+    check("unknown board: handshake", boardHandshake(fd, stranger, gatewayKey));
+    check("unknown board: data exchange", boardEcho(fd, stranger, gatewayKey, "new\r\n"));
+    check("resyncs and resumes counted", gateway.resyncs == 4 && gateway.resumes == 1);
+
+    close(fd);
+    gateway.stop();
+    return ok ? 0 : 1;
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s (--pty N | --unix PATH | --sim N [--sweep] | --selftest)"
+            " [--workers W] [--concurrency C] [--blocks B] [--verbose]\n", name);
+}
+
+int main(int argc, char** argv) {
+    unsigned int ptys = 0, simSessions = 0;
+    unsigned int workers = std::max(1u, std::thread::hardware_concurrency());
+    unsigned int concurrency = 256, blockCount = 64;
+    const char* unixPath = NULL;
+    bool sweep = false, verbose = false, runSelftest = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--pty" && hasValue) {
+            ptys = atoi(argv[++i]);
+        } else if (arg == "--unix" && hasValue) {
+            unixPath = argv[++i];
+        } else if (arg == "--sim" && hasValue) {
+            simSessions = atoi(argv[++i]);
+        } else if (arg == "--workers" && hasValue) {
+            workers = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--concurrency" && hasValue) {
+            concurrency = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--blocks" && hasValue) {
+            blockCount = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--sweep") {
+            sweep = true;
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg == "--selftest") {
+            runSelftest = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (runSelftest) {
+        return selftest(workers);
+    }
+    if (ptys == 0 && unixPath == NULL && simSessions == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // every simulated session needs two descriptors
+    rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    KeyPair gatewayKey = keyGeneration();
+
+    if (simSessions > 0) {
+        std::vector<SimKey> keys(16);
+        for (SimKey& k : keys) {
+            k.key = keyGeneration();
+            for (int c = 0; c < 256; c++) {
+                k.echo[c] = sketch::encrypt((char) c, k.key.e, k.key.n);
+            }
+        }
+        std::vector<unsigned int> counts;
+        if (sweep) {
+            unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int w = 1; w < cores; w *= 2) {
+                counts.push_back(w);
+            }
+            counts.push_back(cores);
+        } else {
+            counts.push_back(workers);
+        }
+        printf("%u sessions, %u open at once, %u blocks each\n", simSessions, concurrency, blockCount);
+        printf("workers sessions/s  hs p50ms  hs p99ms     blocks/s  errors\n");
+        bool ok = true;
+        for (unsigned int w : counts) {
+            Gateway gateway(w, gatewayKey, false);
+            gateway.start();
+            SimResult r = simulate(gateway, gatewayKey, keys, simSessions, concurrency, blockCount);
+            gateway.stop();
+            printResult(w, r);
+            ok = ok && r.errors == 0;
+        }
+        return ok ? 0 : 1;
+    }
+
+    Gateway gateway(workers, gatewayKey, verbose);
+    for (unsigned int i = 0; i < ptys; i++) {
+        std::string path = gateway.openPty();
+        if (path.empty()) {
+            return 1;
+        }
+        printf("board %u: %s\n", i, path.c_str());
+    }
+    if (unixPath != NULL && !gateway.listenUnix(unixPath)) {
+        return 1;
+    }
+    printf("gateway key: e = %u, n = %u, %u workers\n", gatewayKey.e, gatewayKey.n, workers);
+    fflush(stdout);
+    gateway.start();
+
+    uint64_t lastBlocks = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+        uint64_t nowBlocks = gateway.blocks;
+        printf("sessions %llu, handshakes %llu, resumed %llu, resyncs %llu, blocks/s %.1f\n",
+               (unsigned long long) gateway.activeSessions.load(),
+               (unsigned long long) gateway.handshakes.load(),
+               (unsigned long long) gateway.resumes.load(),
+               (unsigned long long) gateway.resyncs.load(),
+               (nowBlocks - lastBlocks) / 5.0);
+        fflush(stdout);
+        lastBlocks = nowBlocks;
+    }
+    return 0;
+}